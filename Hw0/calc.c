@@ -1,8 +1,1253 @@
+#define _GNU_SOURCE // memrchr
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-int main() {
-    char buffer[11]; // Maximum input length of 10 characters + 1 for null terminator
+#include "../Hw1/shm_ring.h"
+
+#define LINE_MAX_CHARS 10          // Maximum input length of a line, longer lines are split like fgets does
+#define BATCH_IN_SIZE (1 << 20)    // Read block size of the batch mode
+#define BATCH_OUT_SIZE (1 << 20)   // Output is collected in a buffer of this size before being written
+#define SEGMENT_SIZE (1 << 20)     // Input handed to a worker thread at a time in parallel mode
+#define SEGMENTS_PER_THREAD 4      // Segments in flight per worker, bounds the memory of the parallel mode
+#define COLUMN_LINES 4096          // Lines parsed into columns before the vector kernel runs over them
+#define COLUMN_BACKOFF_MAX 64      // Most batches of mixed input evaluated line by line before columns are tried again
+#define PROGRAM_CODE_MAX 256       // Bytecode bytes of one compiled line
+#define PROGRAM_CONST_MAX 64       // Constants of one compiled line
+#define EXPR_MAX_VARS 256          // Distinct variable names, a slot index fits in one bytecode byte
+#define EXPR_MAX_DEPTH 64          // Nesting of parentheses, unary signs and chained assignments in one line
+#define EXPR_CACHE_SLOTS 4096      // Compiled lines kept, keyed on the line text
+
+/*Output buffer of the batch mode, written to the file descriptor only when it fills up or at the end.
+Once a write failed the buffer drops everything and 'failed' tells the caller to stop evaluating.
+With fd set to -1 the buffer grows instead, which is how the parallel mode keeps each segment's output. With a
+ring the output is written into it instead of fd, for the consumer of a "calc -b |> ..." pipeline.*/
+struct outbuf {
+    char* data;
+    size_t len;
+    size_t cap;
+    int fd;
+    int failed;
+    struct shm_ring* ring;
+};
+
+static int write_all(int fd, const char* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0) {
+            perror("write");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*Copies data into the ring, waiting for room as needed. Fails once the consumer stopped reading.*/
+static int ring_write_all(struct shm_ring* ring, const char* data, size_t len) {
+    while (len > 0) {
+        char* p;
+        size_t room = shm_ring_write_span(ring, &p, NULL);
+        if (room == 0) return -1;
+        size_t n = room < len ? room : len;
+        memcpy(p, data, n);
+        shm_ring_commit(ring, n);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int out_flush(struct outbuf* out) {
+    int r = out->ring != NULL ? ring_write_all(out->ring, out->data, out->len) : write_all(out->fd, out->data, out->len);
+    if (r != 0) {
+        out->failed = 1;
+    }
+    out->len = 0;
+    return out->failed ? -1 : 0;
+}
+
+/*Makes sure 'len' more bytes fit in the buffer, flushing or growing it*/
+static void out_reserve(struct outbuf* out, size_t len) {
+    if (out->len + len > out->cap) {
+        if (out->fd >= 0) {
+            out_flush(out);
+        }
+        else {
+            size_t cap = out->cap ? out->cap * 2 : BATCH_OUT_SIZE;
+            while (out->len + len > cap) {
+                cap *= 2;
+            }
+            char* data = realloc(out->data, cap);
+            if (data == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            out->data = data;
+            out->cap = cap;
+        }
+    }
+}
+
+static void out_put(struct outbuf* out, const char* s, size_t len) {
+    out_reserve(out, len);
+    if (out->failed) return;
+    memcpy(out->data + out->len, s, len);
+    out->len += len;
+}
+
+/*Appends the result followed by a newline, the same text printf("%d\n") would produce*/
+static void out_put_int(struct outbuf* out, int value) {
+    char digits[16];
+    char* p = digits + sizeof(digits);
+    unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    *--p = '\n';
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    out_put(out, p, digits + sizeof(digits) - p);
+}
+
+/*Whitespace as seen by scanf: space, \t, \n, \v, \f and \r*/
+static const unsigned char is_space[256] = {
+    ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1, [' '] = 1
+};
+
+/*Parses an optionally signed decimal number at s[*i], like the %d conversion. Returns 0 if there is none.*/
+static int parse_int(const char* s, size_t len, size_t* i, long* value) {
+    size_t j = *i;
+    int negative = 0;
+    long v = 0;
+
+    while (j < len && is_space[(unsigned char)s[j]]) j++;
+    if (j < len && (s[j] == '-' || s[j] == '+')) {
+        negative = s[j] == '-';
+        j++;
+    }
+    size_t first_digit = j;
+    while (j < len && (unsigned char)(s[j] - '0') < 10) {
+        v = v * 10 + (s[j] - '0');
+        j++;
+    }
+    if (j == first_digit) return 0;
+
+    *value = negative ? -v : v;
+    *i = j;
+    return 1;
+}
+
+/*Evaluates one line (without its newline) exactly like the interactive loop: the result for a valid
+"digit op digit" expression, the line itself otherwise. Returns 1 if the line is "exit".*/
+static int eval_line(const char* line, size_t len, struct outbuf* out) {
+    // printf("%s") and strcmp stop at an embedded NUL, so the line does too
+    const char* nul = memchr(line, '\0', len);
+    if (nul != NULL) {
+        len = nul - line;
+    }
+
+    if (len == 4 && memcmp(line, "exit", 4) == 0) {
+        return 1;
+    }
+
+    size_t i = 0;
+    long first, second;
+    char op;
+
+    if (parse_int(line, len, &i, &first)) {
+        while (i < len && is_space[(unsigned char)line[i]]) i++;
+        if (i < len) {
+            op = line[i++];
+            if (parse_int(line, len, &i, &second)) {
+                // Ensure the numbers are single-digit natural numbers
+                if ((unsigned long)first <= 9 && (unsigned long)second <= 9) {
+                    int FirstNum = (int)first, SecondNum = (int)second;
+                    switch (op) {
+                    case '+':
+                        out_put_int(out, FirstNum + SecondNum);
+                        return 0;
+                    case '-':
+                        out_put_int(out, FirstNum - SecondNum);
+                        return 0;
+                    case '*':
+                        out_put_int(out, FirstNum * SecondNum);
+                        return 0;
+                    case '/':
+                        if (SecondNum == 0) break; // Division by zero is echoed like any invalid input
+                        out_put_int(out, FirstNum / SecondNum);
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // Print the original input if the format, the numbers or the operator are invalid
+    out_put(out, line, len);
+    out_put(out, "\n", 1);
+    return 0;
+}
+
+/*Finds the next line of data[pos..len), cut the way fgets with an 11-byte buffer cuts lines, so a line longer
+than LINE_MAX_CHARS is handled as several lines. A trailing piece without a newline is only taken at the end of
+input. Returns 0 if the line is incomplete.*/
+static int next_line(const char* data, size_t len, size_t pos, int at_eof, size_t* line_len, size_t* used) {
+    size_t avail = len - pos;
+    size_t window = avail < LINE_MAX_CHARS ? avail : LINE_MAX_CHARS;
+    const char* nl = memchr(data + pos, '\n', window);
+
+    if (nl != NULL) {
+        *line_len = nl - (data + pos);
+        *used = *line_len + 1;
+        return 1;
+    }
+    if (avail >= LINE_MAX_CHARS || at_eof) {
+        *line_len = window;
+        *used = window;
+        return 1;
+    }
+    return 0;
+}
+
+/*Evaluates the lines found in data[0..len) one at a time. Returns the number of bytes consumed, or -1 once
+"exit" was seen or the output failed.*/
+static long eval_block_lines(const char* data, size_t len, int at_eof, struct outbuf* out) {
+    size_t pos = 0, line_len, used;
+
+    while (pos < len && next_line(data, len, pos, at_eof, &line_len, &used)) {
+        if (eval_line(data + pos, line_len, out) || out->failed) {
+            return -1;
+        }
+        pos += used;
+    }
+    return pos;
+}
+
+typedef int32_t v8i __attribute__((vector_size(32)));
+typedef float v8f __attribute__((vector_size(32)));
+
+/*Lines of a block in structure-of-arrays form. Lanes holding a valid "digit op digit" expression are evaluated
+by the vector kernel, every other lane (bad format, bad operator, division by zero) is echoed.*/
+struct columns {
+    int32_t a[COLUMN_LINES];
+    int32_t b[COLUMN_LINES];
+    int32_t op[COLUMN_LINES];
+    int32_t result[COLUMN_LINES];
+    const char* line[COLUMN_LINES];
+    unsigned char len[COLUMN_LINES];
+    unsigned char valid[COLUMN_LINES];
+};
+
+/*Computes every operator for eight lanes at once and keeps, per lane, the one its operator selects. Operands are
+single digits, so the float quotient truncates to the exact integer quotient.*/
+static void eval_columns(struct columns* col, size_t n) {
+    for (size_t i = 0; i < n; i += 8) {
+        v8i a, b, op;
+        memcpy(&a, col->a + i, sizeof(a));
+        memcpy(&b, col->b + i, sizeof(b));
+        memcpy(&op, col->op + i, sizeof(op));
+
+        v8i divisor = b + ((b == 0) & 1); // Zero divisors are echoed lanes, any value keeps them harmless
+        v8i quotient = __builtin_convertvector(__builtin_convertvector(a, v8f) / __builtin_convertvector(divisor, v8f), v8i);
+        v8i result = ((op == '+') & (a + b)) | ((op == '-') & (a - b)) | ((op == '*') & (a * b)) | ((op == '/') & quotient);
+
+        memcpy(col->result + i, &result, sizeof(result));
+    }
+}
+
+/*Matches a single digit, an operator and a single digit with any spacing ("d o d", "d+d", " d * d"), which is
+how nearly every valid line is spelled. Returns 0 if the line needs the general tokenizer (signs, several digits,
+anything else); what follows the second digit is ignored there as well.*/
+static int parse_simple(const char* line, size_t len, long* first, char* op, long* second) {
+    size_t i = 0;
+
+    while (i < len && is_space[(unsigned char)line[i]]) i++;
+    if (i + 1 >= len || (unsigned char)(line[i] - '0') >= 10 || (unsigned char)(line[i + 1] - '0') < 10) return 0;
+    *first = line[i++] - '0';
+    while (i < len && is_space[(unsigned char)line[i]]) i++;
+    if (i >= len) return 0;
+    *op = line[i++];
+    while (i < len && is_space[(unsigned char)line[i]]) i++;
+    if (i >= len || (unsigned char)(line[i] - '0') >= 10 || (i + 1 < len && (unsigned char)(line[i + 1] - '0') < 10)) return 0;
+    *second = line[i] - '0';
+    return 1;
+}
+
+/*Parses a line into lane i. Returns 0 if it took the general tokenizer.*/
+static int parse_lane(struct columns* col, size_t i, const char* line, size_t len) {
+    long first, second;
+    size_t pos = 0;
+    int ok, simple;
+    char op = 0;
+
+    simple = parse_simple(line, len, &first, &op, &second);
+    if (simple) {
+        ok = 1;
+    }
+    else {
+        ok = parse_int(line, len, &pos, &first);
+        while (ok && pos < len && is_space[(unsigned char)line[pos]]) pos++;
+        ok = ok && pos < len;
+        if (ok) {
+            op = line[pos++];
+            ok = parse_int(line, len, &pos, &second);
+        }
+        ok = ok && (unsigned long)first <= 9 && (unsigned long)second <= 9;
+    }
+
+    ok = ok && (op == '+' || op == '-' || op == '*' || (op == '/' && second != 0));
+    col->valid[i] = (unsigned char)ok;
+    col->a[i] = ok ? (int32_t)first : 0;
+    col->b[i] = ok ? (int32_t)second : 0;
+    col->op[i] = ok ? op : 0;
+    col->line[i] = line;
+    col->len[i] = (unsigned char)len;
+    return simple;
+}
+
+/*Writes the lanes back in input order, results for valid lanes and the line itself for the others. Room for the
+longest possible output is reserved once, results lie in -9..81 so they are at most two characters and a sign.*/
+static void emit_columns(const struct columns* col, size_t n, struct outbuf* out) {
+    out_reserve(out, n * (LINE_MAX_CHARS + 1));
+    if (out->failed) return;
+    char* p = out->data + out->len;
+
+    for (size_t i = 0; i < n; i++) {
+        if (col->valid[i]) {
+            int r = col->result[i];
+            if (r < 0) {
+                *p++ = '-';
+                r = -r;
+            }
+            if (r >= 10) {
+                *p++ = '0' + r / 10;
+            }
+            *p++ = '0' + r % 10;
+        }
+        else {
+            memcpy(p, col->line[i], col->len[i]);
+            p += col->len[i];
+        }
+        *p++ = '\n';
+    }
+    out->len = p - out->data;
+}
+
+/*Evaluates the lines found in data[0..len) in COLUMN_LINES batches: they are parsed into columns, evaluated by
+the vector kernel and written back in order. Output is the same as eval_block_lines. When most lines of a batch
+needed the general tokenizer (mixed input) the columns do not pay off, and the following batches are evaluated
+line by line; the columns are tried again after 1, 2, 4... up to COLUMN_BACKOFF_MAX batches. Returns the number
+of bytes consumed, or -1 once "exit" was seen or the output failed.*/
+static long eval_block(const char* data, size_t len, int at_eof, struct outbuf* out) {
+    static __thread struct columns col;
+    static __thread unsigned int skip, backoff;
+    size_t pos = 0, line_len, used;
+
+    while (1) {
+        size_t n = 0, slow = 0;
+        int exit_seen = 0;
+
+        if (skip > 0) {
+            while (n < COLUMN_LINES && pos < len && next_line(data, len, pos, at_eof, &line_len, &used)) {
+                if (eval_line(data + pos, line_len, out) || out->failed) {
+                    return -1;
+                }
+                pos += used;
+                n++;
+            }
+            if (n < COLUMN_LINES) return pos;
+            skip--;
+            continue;
+        }
+
+        while (n < COLUMN_LINES && pos < len && next_line(data, len, pos, at_eof, &line_len, &used)) {
+            const char* line = data + pos;
+            const char* nul = memchr(line, '\0', line_len);
+            if (nul != NULL) {
+                line_len = nul - line; // printf("%s") and strcmp stop at an embedded NUL
+            }
+            if (line_len == 4 && memcmp(line, "exit", 4) == 0) {
+                exit_seen = 1;
+                break;
+            }
+            slow += !parse_lane(&col, n++, line, line_len);
+            pos += used;
+        }
+        if (n == 0 && !exit_seen) return pos;
+        if (slow * 2 > n) {
+            backoff = backoff == 0 ? 1 : backoff < COLUMN_BACKOFF_MAX ? backoff * 2 : backoff;
+            skip = backoff;
+        }
+        else {
+            backoff = 0;
+        }
+
+        // Pad the last vector with lanes that evaluate to nothing
+        for (size_t i = n; i % 8 != 0; i++) {
+            col.a[i] = col.b[i] = col.op[i] = 0;
+        }
+        eval_columns(&col, n);
+        emit_columns(&col, n, out);
+        if (exit_seen || out->failed) return -1;
+    }
+}
+
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*Benchmark mode: evaluates a file with the per-line loop and with the columnar path into memory, checks that the
+outputs match and prints the throughput of both.*/
+static int run_column_bench(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        perror(path);
+        return 1;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+
+    size_t lines = 0;
+    for (char* p = map; (p = memchr(p, '\n', map + st.st_size - p)) != NULL; p++) {
+        lines++;
+    }
+
+    struct outbuf by_line = { NULL, 0, 0, -1, 0, NULL }, by_column = { NULL, 0, 0, -1, 0, NULL };
+    double t0 = seconds_now();
+    eval_block_lines(map, st.st_size, 1, &by_line);
+    double t1 = seconds_now();
+    eval_block(map, st.st_size, 1, &by_column);
+    double t2 = seconds_now();
+
+    int same = by_line.len == by_column.len && memcmp(by_line.data, by_column.data, by_line.len) == 0;
+    printf("lines %zu\n", lines);
+    printf("per-line %.0f lines/s\n", lines / (t1 - t0));
+    printf("columnar %.0f lines/s\n", lines / (t2 - t1));
+    printf("output %s\n", same ? "identical" : "DIFFERENT");
+
+    free(by_line.data);
+    free(by_column.data);
+    munmap(map, st.st_size);
+    close(fd);
+    return same ? 0 : 1;
+}
+
+/*Evaluates the lines arriving through a shared-memory ring set up by myshell ("generator |> calc"). Lines are
+evaluated in place in the ring, without a system call unless the ring runs empty. Returns 0 if the ring is not
+usable, the input then arrives on stdin as with an ordinary pipe.*/
+static int eval_ring(const char* fd_text, struct outbuf* out) {
+    struct shm_ring ring;
+    size_t have = 0;
+
+    if (shm_ring_attach(atoi(fd_text), &ring) != 0) {
+        return 0; // myshell's relay falls back to the pipe when nobody opens the ring
+    }
+    if (!shm_ring_open_reader(&ring)) {
+        shm_ring_detach(&ring);
+        return 0;
+    }
+
+    while (1) {
+        const char* data;
+        int eof;
+        // Whatever is evaluated goes out before waiting for more, so results show up while the producer runs
+        if (out->len > 0 && !shm_ring_readable(&ring, have) && out_flush(out) != 0) {
+            break;
+        }
+        size_t avail = shm_ring_read_span(&ring, have, &data, &eof);
+        long used = eval_block(data, avail, eof, out);
+        if (used < 0 || eof) {
+            break; // "exit", failed output or end of input, at the end of input every byte was taken
+        }
+        shm_ring_consume(&ring, used);
+        have = avail - used;
+    }
+
+    // Lets a producer that is still writing stop
+    shm_ring_close_reader(&ring);
+    shm_ring_detach(&ring);
+    return 1;
+}
+
+/*Takes the writer role of the ring of a "calc -b |> consumer" pipeline, so the output reaches the consumer without
+a pipe. Returns 0 if there is none, the consumer does not read it or the ring cannot be written in order right now;
+the output then goes to stdout, where myshell's relay picks it up.*/
+static int ring_output(struct shm_ring* ring) {
+    const char* fd_text = getenv(SHM_RING_OUT_ENV);
+    struct timespec tick = { 0, SHM_RING_TICK_NS };
+
+    if (fd_text == NULL || shm_ring_attach(atoi(fd_text), ring) != 0) {
+        return 0;
+    }
+    unsetenv(SHM_RING_OUT_ENV); // the ring is this process's to write, not its children's
+    if (!shm_ring_wait_reader(ring, &tick) || !shm_ring_open_producer(ring, STDOUT_FILENO)) {
+        shm_ring_detach(ring);
+        return 0;
+    }
+    return 1;
+}
+
+/*Batch mode: reads the input in large blocks (or maps it when a file is given, or takes it from the shared-memory
+ring of myshell) and writes the results through a large output buffer, producing the same output as the
+interactive loop.*/
+static int run_batch(const char* path) {
+    struct outbuf out;
+    struct shm_ring ring;
+    int status = 0;
+
+    out.data = malloc(BATCH_OUT_SIZE);
+    out.len = 0;
+    out.cap = BATCH_OUT_SIZE;
+    out.fd = STDOUT_FILENO;
+    out.failed = 0;
+    out.ring = NULL;
+    if (out.data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    // The input is opened first, so the writer role is only taken by a run that gets to write
+    int fd = -1;
+    struct stat st;
+    if (path != NULL && ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0)) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        free(out.data);
+        return 1;
+    }
+    if (ring_output(&ring)) {
+        out.ring = &ring;
+    }
+
+    if (path != NULL) {
+        if (st.st_size > 0) {
+            char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                perror("mmap");
+                status = 1;
+            }
+            else {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                eval_block(map, st.st_size, 1, &out);
+                munmap(map, st.st_size);
+            }
+        }
+        close(fd);
+    }
+    else if (getenv(SHM_RING_ENV) != NULL && eval_ring(getenv(SHM_RING_ENV), &out)) {
+        // The whole input came through the ring
+    }
+    else {
+        char* in = malloc(BATCH_IN_SIZE);
+        size_t len = 0;
+        if (in == NULL) {
+            perror("malloc");
+            status = 1;
+        }
+        while (in != NULL) {
+            ssize_t n = read(STDIN_FILENO, in + len, BATCH_IN_SIZE - len);
+            if (n < 0) {
+                perror("read");
+                status = 1;
+                break;
+            }
+            len += n;
+            long used = eval_block(in, len, n == 0, &out);
+            if (used < 0 || n == 0) {
+                break; // "exit", failed output or end of input
+            }
+            // Keep the incomplete line (shorter than LINE_MAX_CHARS) for the next read
+            memmove(in, in + used, len - used);
+            len -= used;
+        }
+        free(in);
+    }
+
+    if (out.failed || out_flush(&out) != 0) {
+        status = 1;
+    }
+    if (out.ring != NULL) {
+        shm_ring_release_writer(out.ring); // stdout stays open until here, see shm_ring.h
+        shm_ring_detach(out.ring);
+    }
+    free(out.data);
+    return status;
+}
+
+/*Returns where the lines of data[0..len) can be split so that both parts are cut into lines exactly as the
+whole would be: right after the last newline or, without one, at a multiple of LINE_MAX_CHARS.*/
+static size_t segment_cut(const char* data, size_t len) {
+    const char* nl = memrchr(data, '\n', len);
+    if (nl != NULL) {
+        return nl - data + 1;
+    }
+    return len - len % LINE_MAX_CHARS;
+}
+
+enum { SEG_FREE, SEG_READY, SEG_DONE };
+
+/*A piece of the input made of whole lines, and the output of its lines once a worker evaluated them*/
+struct segment {
+    const char* data;
+    size_t len;
+    char* own;             // buffer holding data when reading from a pipe, NULL for mapped input
+    struct outbuf out;
+    int exit_seen;
+    int state;
+};
+
+/*Input of the parallel mode, either a mapped file or a descriptor read in SEGMENT_SIZE blocks*/
+struct input {
+    const char* map;
+    size_t map_len;
+    size_t pos;
+    int fd;
+    char* carry;           // bytes read past the last cut, they start the next segment
+    size_t carry_len;
+    int eof;
+    int error;             // a read failed, the input up to there is still evaluated
+};
+
+/*Fills a segment with the next whole lines of the input. Returns 0 when the input is exhausted.*/
+static int input_next(struct input* in, struct segment* seg) {
+    seg->exit_seen = 0;
+    seg->out.len = 0;
+
+    if (in->map != NULL) {
+        size_t avail = in->map_len - in->pos;
+        if (avail == 0) return 0;
+        seg->data = in->map + in->pos;
+        seg->len = avail <= SEGMENT_SIZE ? avail : segment_cut(seg->data, SEGMENT_SIZE);
+        in->pos += seg->len;
+        return 1;
+    }
+
+    if (in->eof && in->carry_len == 0) return 0;
+    if (seg->own == NULL) {
+        seg->own = malloc(2 * SEGMENT_SIZE);
+        if (seg->own == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    size_t len = in->carry_len;
+    memcpy(seg->own, in->carry, len);
+    while (!in->eof && len < SEGMENT_SIZE) {
+        ssize_t n = read(in->fd, seg->own + len, 2 * SEGMENT_SIZE - len);
+        if (n < 0) {
+            perror("read");
+            in->error = 1;
+            n = 0;
+        }
+        if (n == 0) {
+            in->eof = 1;
+        }
+        len += n;
+    }
+
+    size_t cut = in->eof ? len : segment_cut(seg->own, len);
+    in->carry_len = len - cut;
+    memcpy(in->carry, seg->own + cut, in->carry_len);
+    seg->data = seg->own;
+    seg->len = cut;
+    return len > 0;
+}
+
+/*Workers take READY segments in input order and evaluate them into the segment's own output buffer*/
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // a segment was filled, or the pool is stopping
+    pthread_cond_t done;   // a segment was evaluated
+    struct segment* slots;
+    unsigned int nslots;
+    unsigned long filled;  // segments handed out by the reader so far
+    unsigned long taken;   // segments picked up by workers so far
+    int stop;
+};
+
+static void* pool_worker(void* arg) {
+    struct pool* pool = arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->taken == pool->filled) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        struct segment* seg = &pool->slots[pool->taken++ % pool->nslots];
+        pthread_mutex_unlock(&pool->lock);
+
+        int exit_seen = eval_block(seg->data, seg->len, 1, &seg->out) < 0;
+
+        pthread_mutex_lock(&pool->lock);
+        seg->exit_seen = exit_seen;
+        seg->state = SEG_DONE;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*Parallel mode: the input is split into newline-aligned segments evaluated by a pool of worker threads, and the
+main thread writes their outputs in input order, stopping after the segment that holds the first "exit".*/
+static int run_parallel(const char* path, int nthreads) {
+    struct input in = { NULL, 0, 0, STDIN_FILENO, NULL, 0, 0, 0 };
+    struct pool pool;
+    pthread_t* threads;
+    int fd = -1, status = 0, started = 0;
+
+    if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads <= 0) nthreads = 1;
+    }
+
+    if (path != NULL) {
+        struct stat st;
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(path);
+            return 1;
+        }
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+        in.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (in.map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return 1;
+        }
+        in.map_len = st.st_size;
+        madvise((void*)in.map, in.map_len, MADV_SEQUENTIAL);
+    }
+    else {
+        in.carry = malloc(2 * SEGMENT_SIZE);
+        if (in.carry == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    pool.nslots = nthreads * SEGMENTS_PER_THREAD;
+    pool.slots = calloc(pool.nslots, sizeof(*pool.slots));
+    threads = malloc(nthreads * sizeof(*threads));
+    if (pool.slots == NULL || threads == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < pool.nslots; i++) {
+        pool.slots[i].out.fd = -1;
+    }
+    pool.filled = pool.taken = 0;
+    pool.stop = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    // Run with the workers that could be started, but never wait on a pool without any
+    while (started < nthreads) {
+        int err = pthread_create(&threads[started], NULL, pool_worker, &pool);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        status = 1;
+    }
+
+    unsigned long written = 0;
+    int more = 1;
+    while (started > 0) {
+        // Keep every free slot filled so the workers never wait on the writer
+        while (more && pool.filled - written < pool.nslots) {
+            struct segment* seg = &pool.slots[pool.filled % pool.nslots];
+            more = input_next(&in, seg);
+            if (!more) break;
+            pthread_mutex_lock(&pool.lock);
+            seg->state = SEG_READY;
+            pool.filled++;
+            pthread_cond_signal(&pool.ready);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        if (written == pool.filled) break;
+
+        // Write the oldest segment as soon as it is evaluated
+        struct segment* seg = &pool.slots[written % pool.nslots];
+        pthread_mutex_lock(&pool.lock);
+        while (seg->state != SEG_DONE) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (write_all(STDOUT_FILENO, seg->out.data, seg->out.len) != 0) {
+            status = 1;
+            break;
+        }
+        seg->state = SEG_FREE;
+        written++;
+        if (seg->exit_seen) break;
+    }
+
+    // Segments past an "exit" may still be evaluated, their output is dropped
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (unsigned int i = 0; i < pool.nslots; i++) {
+        free(pool.slots[i].out.data);
+        free(pool.slots[i].own);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.ready);
+    pthread_cond_destroy(&pool.done);
+    free(pool.slots);
+    free(threads);
+    free(in.carry);
+    if (in.map != NULL) {
+        munmap((void*)in.map, in.map_len);
+        close(fd);
+    }
+    if (in.error) {
+        status = 1;
+    }
+    return status;
+}
+
+/*Expression mode: every line is an expression over 64-bit integers with + - * / %, parentheses, unary minus and
+variables ("x = 2 * (y + 1)"). A line is compiled once into stack bytecode, with constant subexpressions folded,
+and the compiled program is cached under the line text so repeated lines are only evaluated. A line whose result
+does not fit in 64 bits is echoed, like one that divides by zero; INT64_MIN is written -9223372036854775808.*/
+enum { OP_CONST, OP_LOAD, OP_STORE, OP_NEG, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD };
+
+struct program {
+    unsigned char code[PROGRAM_CODE_MAX];  // opcodes, OP_CONST/OP_LOAD/OP_STORE followed by a one-byte operand
+    int64_t consts[PROGRAM_CONST_MAX];
+    int len;
+    int nconsts;
+    int valid;                             // 0 if the line does not compile, it is then echoed
+};
+
+struct cache_entry {
+    char* text;
+    struct program prog;
+};
+
+static char* var_names[EXPR_MAX_VARS];
+static int64_t var_values[EXPR_MAX_VARS];
+static unsigned char var_defined[EXPR_MAX_VARS];
+static int var_count;
+static struct cache_entry expr_cache[EXPR_CACHE_SLOTS];
+
+/*Compiler state. 'error' is set on the first syntax error, when the program does not fit or when it nests deeper
+than EXPR_MAX_DEPTH. Names not seen before get the slots after var_count but are only added to the variable
+table once the whole line compiled.*/
+struct compiler {
+    const char* p;
+    struct program* prog;
+    int error;
+    int depth;
+    int nnew;
+    const char* new_names[EXPR_MAX_VARS];
+    size_t new_lens[EXPR_MAX_VARS];
+};
+
+/*Describes the code a subexpression compiled to, so constant operands can be folded*/
+struct operand {
+    int is_const;
+    int64_t value;
+    int code_start;
+    int const_start;
+};
+
+static int var_slot(struct compiler* c, const char* name, size_t len) {
+    for (int i = 0; i < var_count; i++) {
+        if (strlen(var_names[i]) == len && memcmp(var_names[i], name, len) == 0) return i;
+    }
+    for (int i = 0; i < c->nnew; i++) {
+        if (c->new_lens[i] == len && memcmp(c->new_names[i], name, len) == 0) return var_count + i;
+    }
+    if (var_count + c->nnew == EXPR_MAX_VARS) return -1;
+    c->new_names[c->nnew] = name;
+    c->new_lens[c->nnew] = len;
+    return var_count + c->nnew++;
+}
+
+/*Adds the names first seen in a line that compiled to the variable table. Returns 0 if that fails.*/
+static int var_commit(struct compiler* c) {
+    for (int i = 0; i < c->nnew; i++) {
+        char* name = strndup(c->new_names[i], c->new_lens[i]);
+        if (name == NULL) return 0;
+        var_names[var_count++] = name;
+    }
+    return 1;
+}
+
+/*Counts one more level of nesting. Returns 0 and flags the line once it nests too deep.*/
+static int enter(struct compiler* c) {
+    if (++c->depth > EXPR_MAX_DEPTH) {
+        c->error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static void skip_spaces(struct compiler* c) {
+    while (isspace((unsigned char)*c->p)) c->p++;
+}
+
+static void emit(struct compiler* c, int op, int arg) {
+    struct program* prog = c->prog;
+    if (prog->len + 2 > PROGRAM_CODE_MAX) {
+        c->error = 1;
+        return;
+    }
+    prog->code[prog->len++] = (unsigned char)op;
+    if (op == OP_CONST || op == OP_LOAD || op == OP_STORE) {
+        prog->code[prog->len++] = (unsigned char)arg;
+    }
+}
+
+static struct operand emit_const(struct compiler* c, int64_t value, int code_start, int const_start) {
+    struct operand r = { 1, value, code_start, const_start };
+    c->prog->len = code_start;
+    c->prog->nconsts = const_start;
+    if (c->prog->nconsts == PROGRAM_CONST_MAX) {
+        c->error = 1;
+        return r;
+    }
+    c->prog->consts[c->prog->nconsts] = value;
+    emit(c, OP_CONST, c->prog->nconsts++);
+    return r;
+}
+
+/*Applies a binary operator. Returns 0 on overflow or division by zero.*/
+static int apply_op(int op, int64_t a, int64_t b, int64_t* result) {
+    switch (op) {
+    case OP_ADD: return !__builtin_add_overflow(a, b, result);
+    case OP_SUB: return !__builtin_sub_overflow(a, b, result);
+    case OP_MUL: return !__builtin_mul_overflow(a, b, result);
+    }
+    if (b == 0 || (a == INT64_MIN && b == -1)) return 0;
+    *result = op == OP_DIV ? a / b : a % b;
+    return 1;
+}
+
+static struct operand compile_expr(struct compiler* c);
+
+/*Compiles a decimal literal. The operand of a unary minus is negated here, so -9223372036854775808 fits.*/
+static struct operand compile_number(struct compiler* c, int negate) {
+    struct operand r = { 0, 0, c->prog->len, c->prog->nconsts };
+    uint64_t limit = negate ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t v = 0;
+
+    while (isdigit((unsigned char)*c->p)) {
+        unsigned int digit = *c->p++ - '0';
+        if (v > (limit - digit) / 10) {
+            c->error = 1;
+            return r;
+        }
+        v = v * 10 + digit;
+    }
+    return emit_const(c, negate ? (int64_t)(0 - v) : (int64_t)v, r.code_start, r.const_start);
+}
+
+static struct operand compile_primary(struct compiler* c) {
+    struct operand r = { 0, 0, c->prog->len, c->prog->nconsts };
+
+    skip_spaces(c);
+    if (isdigit((unsigned char)*c->p)) {
+        return compile_number(c, 0);
+    }
+    if (isalpha((unsigned char)*c->p) || *c->p == '_') {
+        const char* name = c->p;
+        while (isalnum((unsigned char)*c->p) || *c->p == '_') c->p++;
+        int slot = var_slot(c, name, c->p - name);
+        if (slot < 0) {
+            c->error = 1;
+            return r;
+        }
+        emit(c, OP_LOAD, slot);
+        return r;
+    }
+    if (*c->p == '(') {
+        c->p++;
+        if (!enter(c)) return r;
+        struct operand inner = compile_expr(c);
+        c->depth--;
+        skip_spaces(c);
+        if (*c->p != ')') {
+            c->error = 1;
+            return r;
+        }
+        c->p++;
+        inner.code_start = r.code_start;
+        inner.const_start = r.const_start;
+        return inner;
+    }
+    c->error = 1;
+    return r;
+}
+
+static struct operand compile_unary(struct compiler* c) {
+    skip_spaces(c);
+    if (*c->p == '-' || *c->p == '+') {
+        int negate = *c->p == '-';
+        int code_start = c->prog->len, const_start = c->prog->nconsts;
+        c->p++;
+        if (!enter(c)) {
+            struct operand r = { 0, 0, code_start, const_start };
+            return r;
+        }
+        skip_spaces(c);
+        if (negate && isdigit((unsigned char)*c->p)) {
+            c->depth--;
+            return compile_number(c, 1);
+        }
+        struct operand r = compile_unary(c);
+        c->depth--;
+        if (!negate) return r;
+        // Negating INT64_MIN overflows, it is left for run time so the line is reported there
+        if (r.is_const && r.value != INT64_MIN) {
+            return emit_const(c, -r.value, code_start, const_start);
+        }
+        emit(c, OP_NEG, 0);
+        r.code_start = code_start;
+        r.const_start = const_start;
+        return r;
+    }
+    return compile_primary(c);
+}
+
+/*Emits a binary operator, folding it when both operands are constants. Division by a constant zero is left for
+run time so the line is still reported as invalid there.*/
+static struct operand compile_binary(struct compiler* c, int op, struct operand left, struct operand right) {
+    int64_t folded;
+    if (left.is_const && right.is_const && apply_op(op, left.value, right.value, &folded)) {
+        return emit_const(c, folded, left.code_start, left.const_start);
+    }
+    emit(c, op, 0);
+    left.is_const = 0;
+    return left;
+}
+
+static struct operand compile_term(struct compiler* c) {
+    struct operand left = compile_unary(c);
+    while (!c->error) {
+        skip_spaces(c);
+        int op = *c->p == '*' ? OP_MUL : *c->p == '/' ? OP_DIV : *c->p == '%' ? OP_MOD : -1;
+        if (op < 0) break;
+        c->p++;
+        left = compile_binary(c, op, left, compile_unary(c));
+    }
+    return left;
+}
+
+static struct operand compile_expr(struct compiler* c) {
+    struct operand left = compile_term(c);
+    while (!c->error) {
+        skip_spaces(c);
+        int op = *c->p == '+' ? OP_ADD : *c->p == '-' ? OP_SUB : -1;
+        if (op < 0) break;
+        c->p++;
+        left = compile_binary(c, op, left, compile_term(c));
+    }
+    return left;
+}
+
+/*Compiles "name = line" or an expression, the whole text must be consumed*/
+static void compile_statement(struct compiler* c) {
+    const char* start = c->p;
+
+    skip_spaces(c);
+    if (isalpha((unsigned char)*c->p) || *c->p == '_') {
+        const char* name = c->p;
+        while (isalnum((unsigned char)*c->p) || *c->p == '_') c->p++;
+        size_t name_len = c->p - name;
+        skip_spaces(c);
+        if (*c->p == '=') {
+            c->p++;
+            int slot = var_slot(c, name, name_len);
+            if (slot < 0 || !enter(c)) {
+                c->error = 1;
+                return;
+            }
+            compile_statement(c);
+            c->depth--;
+            emit(c, OP_STORE, slot);
+            return;
+        }
+        c->p = start; // Not an assignment, parse it again as an expression
+    }
+    compile_expr(c);
+}
+
+static void compile_line(const char* text, struct program* prog) {
+    struct compiler c;
+
+    c.p = text;
+    c.prog = prog;
+    c.error = 0;
+    c.depth = 0;
+    c.nnew = 0;
+    prog->len = 0;
+    prog->nconsts = 0;
+    compile_statement(&c);
+    skip_spaces(&c);
+    prog->valid = !c.error && *c.p == '\0' && var_commit(&c);
+}
+
+/*Runs a compiled line. Returns 0 on overflow, division by zero or when an undefined variable is read.*/
+static int run_program(const struct program* prog, int64_t* result) {
+    int64_t stack[PROGRAM_CODE_MAX];
+    int sp = 0;
+
+    for (int pc = 0; pc < prog->len; pc++) {
+        int op = prog->code[pc];
+        switch (op) {
+        case OP_CONST:
+            stack[sp++] = prog->consts[prog->code[++pc]];
+            break;
+        case OP_LOAD:
+            if (!var_defined[prog->code[++pc]]) return 0;
+            stack[sp++] = var_values[prog->code[pc]];
+            break;
+        case OP_STORE:
+            var_values[prog->code[++pc]] = stack[sp - 1];
+            var_defined[prog->code[pc]] = 1;
+            break;
+        case OP_NEG:
+            if (stack[sp - 1] == INT64_MIN) return 0;
+            stack[sp - 1] = -stack[sp - 1];
+            break;
+        default:
+            sp--;
+            if (!apply_op(op, stack[sp - 1], stack[sp], &stack[sp - 1])) return 0;
+            break;
+        }
+    }
+    *result = stack[0];
+    return 1;
+}
+
+/*Returns the compiled program of a line, compiling it on a cache miss*/
+static const struct program* expr_lookup(const char* text) {
+    unsigned int h = 2166136261u;
+    for (const char* t = text; *t; t++) {
+        h = (h ^ (unsigned char)*t) * 16777619u;
+    }
+    struct cache_entry* e = &expr_cache[h & (EXPR_CACHE_SLOTS - 1)];
+
+    if (e->text == NULL || strcmp(e->text, text) != 0) {
+        free(e->text);
+        e->text = strdup(text);
+        compile_line(text, &e->prog); // Without a text copy the entry is simply never hit
+    }
+    return &e->prog;
+}
+
+static int run_expressions(const char* path) {
+    FILE* in = stdin;
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (path != NULL) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            perror(path);
+            return 1;
+        }
+    }
+
+    while ((len = getline(&line, &cap, in)) >= 0) {
+        line[strcspn(line, "\n")] = 0;
+
+        if (strcmp(line, "exit") == 0) {
+            break;
+        }
+
+        const struct program* prog = expr_lookup(line);
+        int64_t result;
+        if (prog->valid && run_program(prog, &result)) {
+            printf("%lld\n", (long long)result);
+        }
+        else {
+            printf("%s\n", line); // Print the original input if it does not compile or cannot be evaluated
+        }
+    }
+
+    free(line);
+    for (int i = 0; i < EXPR_CACHE_SLOTS; i++) {
+        free(expr_cache[i].text);
+    }
+    for (int i = 0; i < var_count; i++) {
+        free(var_names[i]);
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // "calc -b [file]" evaluates the whole input in batch mode, which is also how input from a myshell ring is read
+    if (argc == 1 && getenv(SHM_RING_ENV) != NULL) {
+        return run_batch(NULL);
+    }
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        return run_batch(argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : NULL);
+    }
+
+    // "calc -j threads [file]" evaluates it on a pool of threads, 0 meaning one per online CPU
+    if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+        char* end;
+        long nthreads = argc > 2 ? strtol(argv[2], &end, 10) : -1;
+        if (argc <= 2 || end == argv[2] || *end != '\0' || nthreads < 0 || nthreads > 1024) {
+            fprintf(stderr, "calc: -j takes a thread count from 0 to 1024\n");
+            return 1;
+        }
+        return run_parallel(argc > 3 && strcmp(argv[3], "-") != 0 ? argv[3] : NULL, (int)nthreads);
+    }
+
+    // "calc -B file" compares the per-line and the columnar evaluation of a file
+    if (argc > 2 && strcmp(argv[1], "-B") == 0) {
+        return run_column_bench(argv[2]);
+    }
+
+    // "calc -e [file]" evaluates full expressions instead of single-digit operations
+    if (argc > 1 && strcmp(argv[1], "-e") == 0) {
+        return run_expressions(argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : NULL);
+    }
+
+    char buffer[LINE_MAX_CHARS + 1]; // Maximum input length of 10 characters + 1 for null terminator
 
     while (1) {
         // Read input from the user
@@ -37,6 +1282,10 @@ int main() {
                     result = FirstNum * SecondNum;
                     break;
                 case '/':
+                    if (SecondNum == 0) {
+                        printf("%s\n", buffer); // Print the original input on division by zero
+                        continue;
+                    }
                     result = FirstNum / SecondNum;
                     break;
                 default:
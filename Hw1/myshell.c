@@ -1,62 +1,769 @@
+#define _GNU_SOURCE // pipe2, memfd_create
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 #include <stdio.h>
+#include <spawn.h>
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <ctype.h> 
+#include <poll.h>
+
+#include "shm_ring.h"
 
 #define BUFFER_SIZE 100
 
-/*This function duplicates a string by allocating new memoryand copying the content from the given string.It's used for storing commands in the history array.*/
-char* my_strdup(const char* str) {
-    int len = strlen(str) + 1; 
-    char* new_str = malloc(len); // Allocate memory
-    if (new_str == NULL) return NULL; // Return NULL if malloc failed
-    memcpy(new_str, str, len); // Copy the string 
-    return new_str;
+#define HISTORY_MAX_ENTRIES (1u << 22) // ring capacity limit, the oldest commands are dropped past it
+#define HISTORY_INIT_ENTRIES 128
+#define HISTORY_INIT_ARENA 4096
+#define HISTORY_INDEX_BUCKETS (1u << 16) // trigram hash buckets of the search index
+#define HISTORY_FILE_NAME ".myshell_history"
+
+#define HASH_BUCKETS 256 // buckets of the command path cache
+
+extern char** environ;
+
+/*Sorted list of the history sequence numbers whose command contains a given trigram.*/
+struct posting {
+    unsigned int* seqs;
+    unsigned int count;
+    unsigned int cap;
+};
+
+/*The history is a ring of offsets into a single arena that holds every command back to back (NUL terminated),
+so recording a command costs no allocation of its own. Each command is also appended to a history file that
+is shared between sessions and loaded through mmap on startup.*/
+struct history {
+    char* arena;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t* offsets;         // arena offset of command seq lives at offsets[seq & (ring_cap - 1)]
+    unsigned int ring_cap;   // always a power of two
+    unsigned int first_seq;  // sequence number of the oldest command still held
+    unsigned int count;
+    struct posting index[HISTORY_INDEX_BUCKETS];
+    int fd;                  // append-only history file, -1 if history is not persisted
+};
+
+static struct history history;
+
+static const char* history_get(struct history* h, unsigned int seq) {
+    return h->arena + h->offsets[seq & (h->ring_cap - 1)];
+}
+
+static unsigned int trigram_bucket(const char* s) {
+    unsigned int t = ((unsigned char)s[0] << 16) | ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (t * 2654435761u) >> 16 & (HISTORY_INDEX_BUCKETS - 1);
+}
+
+/*Adds every trigram of the command to the index. Sequence numbers only grow, so the posting lists stay sorted.*/
+static void history_index(struct history* h, const char* cmd, size_t len, unsigned int seq) {
+    for (size_t i = 0; i + 3 <= len; i++) {
+        struct posting* p = &h->index[trigram_bucket(cmd + i)];
+        if (p->count > 0 && p->seqs[p->count - 1] == seq) {
+            continue; // trigram (or a colliding one) already seen in this command
+        }
+        if (p->count == p->cap) {
+            unsigned int cap = p->cap ? p->cap * 2 : 8;
+            unsigned int* seqs = realloc(p->seqs, cap * sizeof(*seqs));
+            if (seqs == NULL) return; // searches fall back to verifying candidates, a missing posting only hides a match
+            p->seqs = seqs;
+            p->cap = cap;
+        }
+        p->seqs[p->count++] = seq;
+    }
+}
+
+/*Moves the live commands to the front of the arena and drops postings of commands that were evicted.*/
+static void history_compact(struct history* h) {
+    size_t start = h->count ? h->offsets[h->first_seq & (h->ring_cap - 1)] : h->arena_len;
+
+    memmove(h->arena, h->arena + start, h->arena_len - start);
+    h->arena_len -= start;
+    for (unsigned int i = 0; i < h->count; i++) {
+        h->offsets[(h->first_seq + i) & (h->ring_cap - 1)] -= start;
+    }
+
+    for (unsigned int b = 0; b < HISTORY_INDEX_BUCKETS; b++) {
+        struct posting* p = &h->index[b];
+        unsigned int stale = 0;
+        while (stale < p->count && p->seqs[stale] < h->first_seq) {
+            stale++;
+        }
+        if (stale > 0) {
+            memmove(p->seqs, p->seqs + stale, (p->count - stale) * sizeof(*p->seqs));
+            p->count -= stale;
+        }
+    }
+}
+
+/*Stores a command in memory only. Returns 0 on success and -1 if memory ran out.*/
+static int history_add(struct history* h, const char* cmd, size_t len) {
+    // Make room in the ring, either by growing it or by dropping the oldest command
+    if (h->count == h->ring_cap) {
+        if (h->ring_cap < HISTORY_MAX_ENTRIES) {
+            unsigned int cap = h->ring_cap ? h->ring_cap * 2 : HISTORY_INIT_ENTRIES;
+            size_t* offsets = malloc(cap * sizeof(*offsets));
+            if (offsets == NULL) return -1;
+            for (unsigned int i = 0; i < h->count; i++) {
+                unsigned int seq = h->first_seq + i;
+                offsets[seq & (cap - 1)] = h->offsets[seq & (h->ring_cap - 1)];
+            }
+            free(h->offsets);
+            h->offsets = offsets;
+            h->ring_cap = cap;
+        }
+        else {
+            h->first_seq++;
+            h->count--;
+        }
+    }
+
+    // Make room in the arena, reclaiming the space of evicted commands before growing it
+    if (h->arena_len + len + 1 > h->arena_cap) {
+        size_t start = h->count ? h->offsets[h->first_seq & (h->ring_cap - 1)] : h->arena_len;
+        if (start >= h->arena_cap / 2) {
+            history_compact(h);
+        }
+        if (h->arena_len + len + 1 > h->arena_cap) {
+            size_t cap = h->arena_cap ? h->arena_cap : HISTORY_INIT_ARENA;
+            while (h->arena_len + len + 1 > cap) {
+                cap *= 2;
+            }
+            char* arena = realloc(h->arena, cap);
+            if (arena == NULL) return -1;
+            h->arena = arena;
+            h->arena_cap = cap;
+        }
+    }
+
+    unsigned int seq = h->first_seq + h->count;
+    h->offsets[seq & (h->ring_cap - 1)] = h->arena_len;
+    memcpy(h->arena + h->arena_len, cmd, len);
+    h->arena[h->arena_len + len] = '\0';
+    h->arena_len += len + 1;
+    h->count++;
+    history_index(h, cmd, len, seq);
+    return 0;
+}
+
+/*Stores a command and appends it to the history file. A single O_APPEND write keeps lines from concurrent sessions
+whole, and the shared lock keeps the write out of a compaction by another session.*/
+static void history_record(struct history* h, const char* cmd) {
+    size_t len = strlen(cmd);
+    if (history_add(h, cmd, len) != 0) {
+        perror("error");
+        return;
+    }
+    if (h->fd >= 0) {
+        struct iovec line[2] = { { (void*)cmd, len }, { "\n", 1 } };
+        flock(h->fd, LOCK_SH);
+        if (writev(h->fd, line, 2) < 0) {
+            perror("error");
+        }
+        flock(h->fd, LOCK_UN);
+    }
+}
+
+/*Drops the first 'drop' bytes of the history file, which was 'seen' bytes long when it was loaded and holds older
+commands than the newest HISTORY_MAX_ENTRIES there. The file is rewritten in place under an exclusive lock, so
+other sessions keep appending to it; a file that shrank meanwhile was already trimmed by another session.*/
+static void history_trim_file(struct history* h, size_t drop, size_t seen) {
+    struct stat st;
+
+    if (flock(h->fd, LOCK_EX) != 0) return;
+    if (fstat(h->fd, &st) == 0 && (size_t)st.st_size >= seen) {
+        char* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+        if (map != MAP_FAILED) {
+            memmove(map, map + drop, st.st_size - drop);
+            munmap(map, st.st_size);
+            if (ftruncate(h->fd, st.st_size - drop) != 0) {
+                perror("error");
+            }
+        }
+    }
+    flock(h->fd, LOCK_UN);
+}
+
+/*Opens the shared history file (MYSHELL_HISTFILE, or ~/.myshell_history) and loads the commands already in it.
+An empty MYSHELL_HISTFILE keeps the history in memory only.*/
+static void history_open(struct history* h) {
+    char path[4096];
+    const char* env = getenv("MYSHELL_HISTFILE");
+
+    h->fd = -1;
+    if (env != NULL) {
+        if (*env == '\0') return;
+        snprintf(path, sizeof(path), "%s", env);
+    }
+    else {
+        const char* home = getenv("HOME");
+        if (home == NULL) return;
+        snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE_NAME);
+    }
+
+    h->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (h->fd < 0) return; // history still works for this session
+
+    struct stat st;
+    flock(h->fd, LOCK_SH);
+    if (fstat(h->fd, &st) != 0 || st.st_size == 0) {
+        flock(h->fd, LOCK_UN);
+        return;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    flock(h->fd, LOCK_UN);
+    if (map == MAP_FAILED) return;
+
+    // Every line is a command; a last line without a newline was cut off and is skipped. Only the newest
+    // HISTORY_MAX_ENTRIES commands are loaded, found by scanning back from the end.
+    char* nl = memrchr(map, '\n', st.st_size);
+    char* end = nl != NULL ? nl + 1 : map;
+    char* start = end;
+    for (unsigned int n = 0; start > map && n < HISTORY_MAX_ENTRIES; n++) {
+        nl = memrchr(map, '\n', start - 1 - map);
+        start = nl != NULL ? nl + 1 : map;
+    }
+    for (char* line = start; line < end; line = nl + 1) {
+        nl = memchr(line, '\n', end - line);
+        if (history_add(h, line, nl - line) != 0) break;
+    }
+    munmap(map, st.st_size);
+
+    // Once the dropped commands outweigh the kept ones, the file is cut down to what was loaded
+    if (start - map > end - start) {
+        history_trim_file(h, start - map, st.st_size);
+    }
+}
+
+static int history_matches(const char* cmd, const char* pattern, size_t len, int prefix) {
+    return prefix ? strncmp(cmd, pattern, len) == 0 : strstr(cmd, pattern) != NULL;
+}
+
+/*Returns the newest sequence number below 'before' whose command contains the pattern (or starts with it when
+'prefix' is set), or -1 if there is none. Patterns of three or more characters only visit the commands listed
+under their rarest trigram.*/
+static long history_find(struct history* h, const char* pattern, int prefix, unsigned int before) {
+    size_t len = strlen(pattern);
+
+    if (len < 3) {
+        while (before > h->first_seq) {
+            before--;
+            if (history_matches(history_get(h, before), pattern, len, prefix)) return before;
+        }
+        return -1;
+    }
+
+    struct posting* best = &h->index[trigram_bucket(pattern)];
+    for (size_t i = 1; i + 3 <= len; i++) {
+        struct posting* p = &h->index[trigram_bucket(pattern + i)];
+        if (p->count < best->count) {
+            best = p;
+        }
+    }
+
+    // Binary search for the first posting not below 'before', then walk towards older commands
+    unsigned int lo = 0, hi = best->count;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (best->seqs[mid] < before) lo = mid + 1;
+        else hi = mid;
+    }
+    while (lo > 0) {
+        unsigned int seq = best->seqs[--lo];
+        if (seq < h->first_seq) break; // evicted, and so is everything older
+        if (history_matches(history_get(h, seq), pattern, len, prefix)) return seq;
+    }
+    return -1;
+}
+
+static void history_close(struct history* h) {
+    for (unsigned int b = 0; b < HISTORY_INDEX_BUCKETS; b++) {
+        free(h->index[b].seqs);
+    }
+    free(h->offsets);
+    free(h->arena);
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+}
+
+/*Cached PATH lookup, like the "hash" builtin of bash: a command name maps to the absolute path it resolved to,
+so launching it again costs no directory scan.*/
+struct hash_entry {
+    struct hash_entry* next;
+    unsigned int hits;
+    char* path;
+    char name[]; // path points into the same allocation, right after the name
+};
+
+static struct hash_entry* hash_table[HASH_BUCKETS];
+static char* hash_path_env; // PATH the cached entries were resolved against
+
+static unsigned int hash_bucket(const char* name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h & (HASH_BUCKETS - 1);
+}
+
+static void hash_reset(void) {
+    for (int b = 0; b < HASH_BUCKETS; b++) {
+        struct hash_entry* e = hash_table[b];
+        while (e != NULL) {
+            struct hash_entry* next = e->next;
+            free(e);
+            e = next;
+        }
+        hash_table[b] = NULL;
+    }
+    free(hash_path_env);
+    hash_path_env = NULL;
+}
+
+static void hash_forget(const char* name) {
+    struct hash_entry** link = &hash_table[hash_bucket(name)];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            struct hash_entry* e = *link;
+            *link = e->next;
+            free(e);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/*Scans the PATH directories for an executable regular file called name, the same search execvp does.
+Returns 0 and fills 'out' on success, -1 otherwise.*/
+static int path_search(const char* name, const char* path_env, char* out, size_t out_size) {
+    const char* dir = path_env;
+    while (1) {
+        const char* end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        struct stat st;
+
+        // An empty PATH element means the current directory
+        if (dir_len == 0) {
+            snprintf(out, out_size, "%s", name);
+        }
+        else {
+            snprintf(out, out_size, "%.*s/%s", (int)dir_len, dir, name);
+        }
+        // Like execvp, the file has to be executable by this user, not just by someone
+        if (stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0) {
+            return 0;
+        }
+        if (end == NULL) return -1;
+        dir = end + 1;
+    }
+}
+
+/*Returns the cached path of a command, resolving and caching it first if needed. Names containing a slash are
+used as they are. Returns NULL if the command is not found. The whole cache is dropped when PATH changes.*/
+static const char* hash_lookup(const char* name) {
+    static char resolved[PATH_MAX];
+
+    if (strchr(name, '/') != NULL) return name;
+
+    const char* path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "/bin:/usr/bin";
+    if (hash_path_env == NULL || strcmp(hash_path_env, path_env) != 0) {
+        hash_reset();
+        hash_path_env = malloc(strlen(path_env) + 1);
+        if (hash_path_env != NULL) {
+            strcpy(hash_path_env, path_env);
+        }
+    }
+
+    unsigned int b = hash_bucket(name);
+    for (struct hash_entry* e = hash_table[b]; e != NULL; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    if (path_search(name, path_env, resolved, sizeof(resolved)) != 0) return NULL;
+
+    size_t name_len = strlen(name) + 1;
+    struct hash_entry* e = malloc(sizeof(*e) + name_len + strlen(resolved) + 1);
+    if (e == NULL) return resolved; // still usable for this launch, just not cached
+    memcpy(e->name, name, name_len);
+    e->path = e->name + name_len;
+    strcpy(e->path, resolved);
+    e->hits = 1;
+    e->next = hash_table[b];
+    hash_table[b] = e;
+    return e->path;
+}
+
+/*The "hash" builtin: with no arguments it lists the cache, "hash -r" empties it and "hash name..." resolves
+and remembers the given commands.*/
+static void hash_builtin(char** args) {
+    if (args[1] == NULL) {
+        int empty = 1;
+        for (int b = 0; b < HASH_BUCKETS; b++) {
+            for (struct hash_entry* e = hash_table[b]; e != NULL; e = e->next) {
+                if (empty) {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4u\t%s\n", e->hits, e->path);
+            }
+        }
+        if (empty) {
+            printf("hash: hash table empty\n");
+        }
+        return;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            hash_reset();
+        }
+        else {
+            hash_forget(args[i]);
+            if (hash_lookup(args[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+            }
+            else {
+                struct hash_entry* e = hash_table[hash_bucket(args[i])];
+                if (e != NULL && strcmp(e->name, args[i]) == 0) {
+                    e->hits = 0; // resolving is not a use
+                }
+            }
+        }
+    }
+}
+
+/*Runs a file that is not a binary (a script without "#!") through /bin/sh, as execvp does on ENOEXEC. Returns
+the error of posix_spawn.*/
+static int spawn_script(pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions, char** args, char** envp) {
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+
+    char** sh_args = malloc((argc + 2) * sizeof(*sh_args));
+    if (sh_args == NULL) return ENOMEM;
+    sh_args[0] = "sh";
+    sh_args[1] = (char*)path;
+    memcpy(sh_args + 2, args + 1, argc * sizeof(*sh_args)); // the rest of args and its NULL
+    int err = posix_spawn(pid, "/bin/sh", actions, NULL, sh_args, envp);
+    free(sh_args);
+    return err;
+}
+
+/*Launches a command through its cached path, with the given file actions (may be NULL) and environment. A cached
+binary that disappeared (ENOENT) is forgotten and looked up again once. Returns the child's pid, or -1 with errno set.*/
+static pid_t spawn_command(char** args, const posix_spawn_file_actions_t* actions, char** envp) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        const char* path = hash_lookup(args[0]);
+        if (path == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+
+        pid_t pid;
+        int err = posix_spawn(&pid, path, actions, NULL, args, envp);
+        if (err == ENOEXEC) {
+            err = spawn_script(&pid, path, actions, args, envp);
+        }
+        if (err == 0) return pid;
+        if (err != ENOENT || strchr(args[0], '/') != NULL) {
+            errno = err;
+            return -1;
+        }
+        hash_forget(args[0]);
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/*Returns a copy of the environment that tells a stage of a "|>" pipeline which descriptor holds the ring, under
+SHM_RING_ENV for the consumer and SHM_RING_OUT_ENV for the producer. The copy is only valid until the next call.*/
+static char** ring_environ(const char* name, int fd) {
+    static char entry[32];
+    size_t n = 0, k = 0, name_len = strlen(name);
+
+    while (environ[n] != NULL) n++;
+    char** envp = malloc((n + 2) * sizeof(*envp));
+    if (envp == NULL) return NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], name, name_len) != 0 || environ[i][name_len] != '=') {
+            envp[k++] = environ[i];
+        }
+    }
+    snprintf(entry, sizeof(entry), "%s=%d", name, fd);
+    envp[k++] = entry;
+    envp[k] = NULL;
+    return envp;
+}
+
+static int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*Relay of a consumer that does not read the ring: copies the producer's output to its stdin*/
+static void relay_to_pipe(int in, int consumer) {
+    char buf[1 << 16];
+    ssize_t n;
+
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (write_all(consumer, buf, n) != 0) return;
+    }
+}
+
+/*Waits up to 'timeout' milliseconds (-1 for good) until the producer's stdout has data or reached its end, and
+returns its poll events, 0 on timeout. A consumer that exits meanwhile closes the ring for reading, which stops a
+producer that writes into the ring itself.*/
+static int relay_poll(struct shm_ring* ring, int in, int consumer, int timeout) {
+    struct pollfd pfd[2] = { { in, POLLIN, 0 }, { consumer, 0, 0 } };
+
+    while (1) {
+        int n = poll(pfd, 2, timeout);
+        if (n < 0 && errno != EINTR) return POLLERR;
+        if (n < 0) continue;
+        if (pfd[1].revents & POLLERR) {
+            shm_ring_close_reader(ring);
+            pfd[1].fd = -1;
+        }
+        if (pfd[0].revents != 0 || timeout >= 0) return pfd[0].revents;
+    }
+}
+
+/*Relay process of "cmd1 |> cmd2", 'consumer' being the write end of the consumer's stdin pipe. A consumer that
+does not open the ring soon after it started gets the producer's output on its stdin. Otherwise the producer's
+output is read straight into the ring, as much as the ring has room for in one read. A program of the producer
+stage may hold the writer role meanwhile and write into the ring itself; what reaches stdout then waits until it
+gave the role back, so nothing is lost and the order holds.*/
+static void ring_relay(int in, int ring_fd, int consumer) {
+    struct shm_ring ring;
+    struct timespec tick = { 0, SHM_RING_TICK_NS };
+
+    if (shm_ring_attach(ring_fd, &ring) != 0) {
+        perror("error");
+        _exit(1);
+    }
+    if (!shm_ring_wait_reader(&ring, &tick)) {
+        relay_to_pipe(in, consumer);
+        _exit(0);
+    }
+
+    // Reads never block, so the role is given back as soon as the pipe is drained
+    fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+    while (!ring.hdr->reader_closed) {
+        int events = relay_poll(&ring, in, consumer, -1);
+        while (!shm_ring_acquire_writer(&ring, SHM_RING_RELAY)) {
+            // A writer keeps its stdout open while it holds the role, so a hang up means it died holding it
+            if (events & (POLLHUP | POLLERR)) {
+                __atomic_store_n(&ring.hdr->writer, SHM_RING_RELAY, __ATOMIC_SEQ_CST);
+                break;
+            }
+            shm_ring_wait_writer(&ring, &tick);
+            events = relay_poll(&ring, in, consumer, 0);
+        }
+
+        int done = 0;
+        while (!done) {
+            char* p;
+            size_t room = shm_ring_write_span(&ring, &p, &tick);
+            if (room == 0) {
+                // Full ring: keep waiting only while the consumer still runs and reads
+                relay_poll(&ring, in, consumer, 0);
+                done = ring.hdr->reader_closed;
+                continue;
+            }
+            ssize_t n = read(in, p, room);
+            if (n > 0) shm_ring_commit(&ring, n);
+            else if (n < 0 && errno == EAGAIN) break;
+            else if (n == 0 || errno != EINTR) done = 1;
+        }
+        if (done) break;
+        shm_ring_release_writer(&ring);
+    }
+
+    shm_ring_close_writer(&ring);
+    _exit(0);
+}
+
+/*Runs "left | right" over an ordinary pipe, or "left |> right" over a shared-memory ring that the right side
+(calc) reads natively. The left side may write into the ring itself (calc -b does); for any other producer a
+relay process fills the ring from its output. If the ring cannot be set up, "|>" runs over an ordinary pipe as
+well.*/
+static void run_pipeline(char** left, char** right, int use_ring, int background) {
+    int data[2], link[2] = { -1, -1 }, ring_fd = -1;
+    pid_t pids[3];
+    int npids = 0;
+    posix_spawn_file_actions_t actions;
+
+    if (pipe2(data, O_CLOEXEC) != 0) {
+        perror("error");
+        return;
+    }
+    if (use_ring) {
+        ring_fd = shm_ring_create(SHM_RING_CAPACITY, data[1]);
+        if (ring_fd >= 0 && pipe2(link, O_CLOEXEC) != 0) {
+            close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+
+    // Producer writes into the pipe, or into the ring through an inherited copy of its descriptor
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, data[1], STDOUT_FILENO);
+    pid_t pid;
+    if (ring_fd < 0) {
+        pid = spawn_command(left, &actions, environ);
+    }
+    else {
+        int child_fd = dup(ring_fd); // dup drops close-on-exec
+        char** envp = child_fd >= 0 ? ring_environ(SHM_RING_OUT_ENV, child_fd) : NULL;
+        pid = spawn_command(left, &actions, envp != NULL ? envp : environ);
+        free(envp);
+        if (child_fd >= 0) close(child_fd);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (pid > 0) pids[npids++] = pid;
+    else perror("error");
+    close(data[1]);
+
+    // Consumer reads the pipe, or the ring through an inherited copy of its descriptor
+    posix_spawn_file_actions_init(&actions);
+    if (ring_fd < 0) {
+        posix_spawn_file_actions_adddup2(&actions, data[0], STDIN_FILENO);
+        pid = spawn_command(right, &actions, environ);
+    }
+    else {
+        int child_fd = dup(ring_fd); // dup drops close-on-exec
+        char** envp = child_fd >= 0 ? ring_environ(SHM_RING_ENV, child_fd) : NULL;
+        posix_spawn_file_actions_adddup2(&actions, link[0], STDIN_FILENO);
+        if (envp != NULL) {
+            pid = spawn_command(right, &actions, envp);
+        }
+        else {
+            pid = -1;
+        }
+        free(envp);
+        if (child_fd >= 0) close(child_fd);
+        close(link[0]);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (pid > 0) pids[npids++] = pid;
+    else perror("error");
+
+    if (ring_fd >= 0) {
+        pid = fork();
+        if (pid == 0) {
+            ring_relay(data[0], ring_fd, link[1]);
+        }
+        if (pid > 0) pids[npids++] = pid;
+        else perror("error");
+        close(ring_fd);
+        close(link[1]);
+    }
+    close(data[0]);
+
+    if (!background) {
+        for (int i = 0; i < npids; i++) {
+            waitpid(pids[i], NULL, 0);
+        }
+    }
 }
 
 int main(void) {
     close(2);
     dup(1);
     char command[BUFFER_SIZE]; /* buffer to store the user's input*/
-    char* history[100]; // Store up to 100 commands
-    int history_count = 0; /*counter to track how many commands have been stored*/
+    history_open(&history);
 
     while (1) {
         fprintf(stdout, "my-shell> ");
         memset(command, 0, BUFFER_SIZE);
-        fgets(command, BUFFER_SIZE, stdin);
+        if (fgets(command, BUFFER_SIZE, stdin) == NULL) {
+            break; // End of input behaves like "exit"
+        }
 
         command[strcspn(command, "\n")] = 0; // Remove newline character from input
 
+        /*"!prefix" recalls the most recent command starting with prefix, which is echoed and then runs as if typed*/
+        if (command[0] == '!' && command[1] != '\0') {
+            long seq = history_find(&history, command + 1, 1, history.first_seq + history.count);
+            if (seq < 0) {
+                fprintf(stderr, "%s: event not found\n", command);
+                continue;
+            }
+            // The shared file may hold commands from other shells that are too long to run here
+            const char* recalled = history_get(&history, seq);
+            if (strlen(recalled) >= BUFFER_SIZE) {
+                fprintf(stderr, "%s: event too long\n", command);
+                continue;
+            }
+            strcpy(command, recalled);
+            printf("%s\n", command);
+        }
+
         /*If the command is "exit", the shell terminates*/
         if (strncmp(command, "exit", 4) == 0 && (strlen(command) == 4 || isspace(command[4]))) {
             break;
         }
 
-        // Store command in history
-        history[history_count] = my_strdup(command);
-        history_count++;
+        // Store command in history, blank lines would only pad the shared history file
+        if (command[0] != '\0') {
+            history_record(&history, command);
+        }
 
-        /*If the command is "history", it prints all stored commands in reverse order*/
+        /*If the command is "history", it prints all stored commands in reverse order.
+        "history <pattern>" prints only the commands containing pattern*/
         if (strncmp(command, "history", 7) == 0) {
-            for (int i = 0; i < history_count; i++) {
-                printf("%d %s\n", history_count - i, history[history_count - 1 - i]);
+            const char* pattern = command + 7;
+            while (isspace((unsigned char)*pattern)) pattern++;
+
+            unsigned int end = history.first_seq + history.count;
+            if (*pattern == '\0') {
+                for (unsigned int seq = end; seq > history.first_seq; seq--) {
+                    printf("%u %s\n", seq, history_get(&history, seq - 1));
+                }
+            }
+            else {
+                long seq = end;
+                while ((seq = history_find(&history, pattern, 0, (unsigned int)seq)) >= 0) {
+                    printf("%ld %s\n", seq + 1, history_get(&history, seq));
+                }
             }
             continue; // Continue to the next loop iteration
         }
 
         /*Checks if the command ends with & to determine if it should run in the background.If so, it sets the background flag and removes the &*/
         int background = 0;
-        if (command[strlen(command) - 1] == '&') {
+        if (command[0] != '\0' && command[strlen(command) - 1] == '&') {
             background = 1;
             command[strlen(command) - 1] = '\0'; // Remove the '&' from command
         }
 
         //The command is split into arguments.
-        //The shell forks a new process to execute the command.If it's a background process, it doesn't wait; otherwise, it waits for the command to finish.
+        //The shell spawns a new process running the command's cached path.If it's a background process, it doesn't wait; otherwise, it waits for the command to finish.
 
         char* args[BUFFER_SIZE];
         int arg_count = 0;
@@ -69,14 +776,40 @@ int main(void) {
         }
         args[arg_count] = NULL; 
 
-        // Fork a process to execute the command
-        pid_t pid = fork();
-        if (pid == 0) { // Child process
-            execvp(args[0], args);
-            perror("error"); // Exec only returns on error
-            exit(1);  
+        if (args[0] == NULL) {
+            continue; // Nothing to run
+        }
+
+        if (strcmp(args[0], "hash") == 0) {
+            hash_builtin(args);
+            continue;
+        }
+
+        // "cmd1 | cmd2" and "cmd1 |> cmd2" run a two-stage pipeline
+        int pipe_at = -1;
+        for (int i = 0; i < arg_count; i++) {
+            if (strcmp(args[i], "|") == 0 || strcmp(args[i], "|>") == 0) {
+                if (pipe_at >= 0) {
+                    pipe_at = -2; // only two stages are supported
+                    break;
+                }
+                pipe_at = i;
+            }
+        }
+        if (pipe_at != -1) {
+            if (pipe_at <= 0 || args[pipe_at + 1] == NULL) {
+                fprintf(stderr, "error: a pipeline takes two commands\n");
+                continue;
+            }
+            int use_ring = args[pipe_at][1] == '>';
+            args[pipe_at] = NULL;
+            run_pipeline(args, args + pipe_at + 1, use_ring, background);
+            continue;
         }
-        else if (pid > 0) { // Parent process
+
+        // Spawn a process to execute the command
+        pid_t pid = spawn_command(args, NULL, environ);
+        if (pid > 0) {
             if (!background) {
                 wait(NULL); // Wait for the child process to finish
             }
@@ -86,10 +819,9 @@ int main(void) {
         }
     }
 
-    // Clean up history
-    for (int i = 0; i < history_count; i++) {
-        free(history[i]);
-    }
+    // Clean up history and the command cache
+    history_close(&history);
+    hash_reset();
 
     return 0;
 }
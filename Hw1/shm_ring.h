@@ -0,0 +1,291 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Single-producer/single-consumer byte ring shared between two processes through a memfd. The file holds a header
+page followed by the data, and the data is mapped twice back to back so every readable or writable range is
+contiguous. Positions only grow; a side sleeps on a futex only when the ring is empty (reader) or full (writer),
+so a steady stream moves without system calls. The consumer finds the ring through the SHM_RING_ENV variable,
+which holds the number of an inherited descriptor. A consumer that does not open the ring within SHM_RING_TICK_NS
+of the writer side is given up on, the data then goes down an ordinary pipe instead.
+
+The ring is filled by a relay that copies the producer stage's stdout pipe into it. A program of that stage may
+instead write into the ring directly: it finds the ring through SHM_RING_OUT_ENV and takes the writer role while
+its stdout is still that pipe and the pipe is empty, then gives the role back when done, keeping stdout open until
+then. The relay only reads the pipe while it holds the role, so output keeps its order, and it alone closes the
+ring, once the pipe reports end of input.*/
+
+#define SHM_RING_ENV "SHMRING_FD"
+#define SHM_RING_OUT_ENV "SHMRING_OUT_FD"
+#define SHM_RING_CAPACITY (4u << 20) // must be a multiple of the page size
+#define SHM_RING_TICK_NS (50 * 1000 * 1000) // wait for the consumer to open the ring, and poll period of a waiting writer
+
+// Who reads the data, decided once by whichever side gets there first
+enum { SHM_RING_UNDECIDED, SHM_RING_READER, SHM_RING_PIPE };
+
+// Who holds the writer role: nobody, a program writing into the ring itself, or the relay copying the pipe
+enum { SHM_RING_NO_WRITER, SHM_RING_PRODUCER, SHM_RING_RELAY };
+
+struct shm_ring_header {
+    uint64_t head;             // bytes written, only the writer stores it
+    char pad0[56];
+    uint64_t tail;             // bytes consumed, only the consumer stores it
+    char pad1[56];
+    uint32_t data_seq;         // futex, bumped when data arrives for a waiting reader
+    uint32_t space_seq;        // futex, bumped when space frees up for a waiting writer
+    uint32_t reader_waiting;
+    uint32_t writer_waiting;
+    uint32_t writer_closed;
+    uint32_t reader_closed;
+    uint32_t mode;             // futex, woken once the reader side is decided
+    uint32_t writer;           // futex, woken when the writer role is given back
+    uint64_t capacity;
+    uint64_t pipe_dev;         // the producer stage's stdout pipe
+    uint64_t pipe_ino;
+};
+
+struct shm_ring {
+    struct shm_ring_header* hdr;
+    char* data;
+    size_t capacity;
+    size_t map_len;
+};
+
+static inline void shm_ring_futex_wait(uint32_t* addr, uint32_t value, const struct timespec* timeout) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static inline void shm_ring_futex_wake(uint32_t* addr, int waiters) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, waiters, NULL, NULL, 0);
+}
+
+/*Creates the memfd of an empty ring, tied to the pipe whose write end is pipe_fd. Returns the descriptor
+(close-on-exec) or -1.*/
+static inline int shm_ring_create(size_t capacity, int pipe_fd) {
+    struct stat st;
+    if (fstat(pipe_fd, &st) != 0) return -1;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    int fd = memfd_create("shm_ring", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, page + capacity) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct shm_ring_header* hdr = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    hdr->capacity = capacity; // the rest of a new memfd reads as zero
+    hdr->pipe_dev = st.st_dev;
+    hdr->pipe_ino = st.st_ino;
+    munmap(hdr, page);
+    return fd;
+}
+
+/*Maps a ring created by shm_ring_create. Returns 0 on success, -1 otherwise.*/
+static inline int shm_ring_attach(int fd, struct shm_ring* ring) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size <= page) return -1;
+    size_t capacity = st.st_size - page;
+
+    // Reserve room for the header and two copies of the data, then map the file over it
+    char* base = mmap(NULL, page + 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return -1;
+    if (mmap(base, page + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(base + page + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) == MAP_FAILED) {
+        munmap(base, page + 2 * capacity);
+        return -1;
+    }
+
+    if (((struct shm_ring_header*)base)->capacity != capacity) {
+        munmap(base, page + 2 * capacity);
+        return -1;
+    }
+
+    ring->hdr = (struct shm_ring_header*)base;
+    ring->data = base + page;
+    ring->capacity = capacity;
+    ring->map_len = page + 2 * capacity;
+    return 0;
+}
+
+static inline void shm_ring_detach(struct shm_ring* ring) {
+    munmap(ring->hdr, ring->map_len);
+}
+
+/*Consumer: takes the ring as its input. Returns 0 if the writer already gave up on it, the data then comes
+through the ordinary pipe.*/
+static inline int shm_ring_open_reader(struct shm_ring* ring) {
+    uint32_t mode = SHM_RING_UNDECIDED;
+    if (__atomic_compare_exchange_n(&ring->hdr->mode, &mode, SHM_RING_READER, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        shm_ring_futex_wake(&ring->hdr->mode, INT_MAX);
+        return 1;
+    }
+    return mode == SHM_RING_READER;
+}
+
+/*Writer side: gives up on a reader that did not open the ring. Returns 1 if the data must go down the pipe.*/
+static inline int shm_ring_claim_pipe(struct shm_ring* ring) {
+    uint32_t mode = SHM_RING_UNDECIDED;
+    if (__atomic_compare_exchange_n(&ring->hdr->mode, &mode, SHM_RING_PIPE, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        shm_ring_futex_wake(&ring->hdr->mode, INT_MAX);
+        return 1;
+    }
+    return 0;
+}
+
+/*Writer side: waits up to 'timeout' for the consumer to open the ring, and claims the pipe if it did not.
+Returns 1 if the consumer reads the ring.*/
+static inline int shm_ring_wait_reader(struct shm_ring* ring, const struct timespec* timeout) {
+    while (__atomic_load_n(&ring->hdr->mode, __ATOMIC_SEQ_CST) == SHM_RING_UNDECIDED) {
+        long r = syscall(SYS_futex, &ring->hdr->mode, FUTEX_WAIT, SHM_RING_UNDECIDED, timeout, NULL, 0);
+        if (r != 0 && errno == ETIMEDOUT) {
+            shm_ring_claim_pipe(ring);
+        }
+    }
+    return __atomic_load_n(&ring->hdr->mode, __ATOMIC_SEQ_CST) == SHM_RING_READER;
+}
+
+/*Takes the writer role for 'who' (SHM_RING_PRODUCER or SHM_RING_RELAY). Returns 0 if someone else holds it.*/
+static inline int shm_ring_acquire_writer(struct shm_ring* ring, uint32_t who) {
+    uint32_t writer = SHM_RING_NO_WRITER;
+    return __atomic_compare_exchange_n(&ring->hdr->writer, &writer, who, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*Gives the writer role back and wakes a relay waiting for it*/
+static inline void shm_ring_release_writer(struct shm_ring* ring) {
+    __atomic_store_n(&ring->hdr->writer, SHM_RING_NO_WRITER, __ATOMIC_SEQ_CST);
+    shm_ring_futex_wake(&ring->hdr->writer, INT_MAX);
+}
+
+/*Waits up to 'timeout' for the writer role to be given back*/
+static inline void shm_ring_wait_writer(struct shm_ring* ring, const struct timespec* timeout) {
+    uint32_t writer = __atomic_load_n(&ring->hdr->writer, __ATOMIC_SEQ_CST);
+    if (writer != SHM_RING_NO_WRITER) {
+        shm_ring_futex_wait(&ring->hdr->writer, writer, timeout);
+    }
+}
+
+/*Program of the producer stage: takes the writer role to write into the ring directly. That is only done while
+out_fd (its stdout) is the pipe the relay copies and holds nothing the relay has yet to copy, so the output keeps
+its order. Returns 0 if the output has to go to out_fd.*/
+static inline int shm_ring_open_producer(struct shm_ring* ring, int out_fd) {
+    struct stat st;
+    int queued;
+
+    if (fstat(out_fd, &st) != 0 || st.st_dev != ring->hdr->pipe_dev || st.st_ino != ring->hdr->pipe_ino) return 0;
+    if (!shm_ring_acquire_writer(ring, SHM_RING_PRODUCER)) return 0;
+    if (ioctl(out_fd, FIONREAD, &queued) != 0 || queued > 0) {
+        shm_ring_release_writer(ring);
+        return 0;
+    }
+    return 1;
+}
+
+/*Writer: waits until the ring has free space and returns how much, with *p pointing at it. Gives up after
+'timeout' (NULL waits for good) and returns 0, as it does once the reader closed the ring.*/
+static inline size_t shm_ring_write_span(struct shm_ring* ring, char** p, const struct timespec* timeout) {
+    struct shm_ring_header* hdr = ring->hdr;
+
+    while (1) {
+        uint32_t seq = __atomic_load_n(&hdr->space_seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&hdr->writer_waiting, 1, __ATOMIC_SEQ_CST);
+        uint64_t head = hdr->head;
+        uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST);
+        int closed = __atomic_load_n(&hdr->reader_closed, __ATOMIC_SEQ_CST);
+
+        if (closed || head - tail < ring->capacity) {
+            __atomic_store_n(&hdr->writer_waiting, 0, __ATOMIC_RELAXED);
+            if (closed) return 0;
+            *p = ring->data + head % ring->capacity;
+            return ring->capacity - (head - tail);
+        }
+        shm_ring_futex_wait(&hdr->space_seq, seq, timeout);
+        __atomic_store_n(&hdr->writer_waiting, 0, __ATOMIC_RELAXED);
+        if (timeout != NULL) return 0;
+    }
+}
+
+/*Writer: publishes n bytes written into the last span*/
+static inline void shm_ring_commit(struct shm_ring* ring, size_t n) {
+    struct shm_ring_header* hdr = ring->hdr;
+    __atomic_store_n(&hdr->head, hdr->head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->reader_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&hdr->data_seq, 1, __ATOMIC_SEQ_CST);
+        shm_ring_futex_wake(&hdr->data_seq, 1);
+    }
+}
+
+/*Relay: no more data will come, the reader sees end of input once it drained the ring*/
+static inline void shm_ring_close_writer(struct shm_ring* ring) {
+    __atomic_store_n(&ring->hdr->writer_closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&ring->hdr->data_seq, 1, __ATOMIC_SEQ_CST);
+    shm_ring_futex_wake(&ring->hdr->data_seq, 1);
+}
+
+/*Consumer: returns 1 if shm_ring_read_span would return without waiting*/
+static inline int shm_ring_readable(struct shm_ring* ring, size_t have) {
+    struct shm_ring_header* hdr = ring->hdr;
+    return __atomic_load_n(&hdr->writer_closed, __ATOMIC_SEQ_CST)
+        || __atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) - hdr->tail > have;
+}
+
+/*Consumer: waits until more than 'have' bytes are readable, or the writer closed the ring, and returns the
+readable byte count with *p pointing at them. *eof is set once nothing more will arrive.*/
+static inline size_t shm_ring_read_span(struct shm_ring* ring, size_t have, const char** p, int* eof) {
+    struct shm_ring_header* hdr = ring->hdr;
+
+    while (1) {
+        uint32_t seq = __atomic_load_n(&hdr->data_seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&hdr->reader_waiting, 1, __ATOMIC_SEQ_CST);
+        // The closed flag is read first, so a writer that closed has already published its last bytes
+        int closed = __atomic_load_n(&hdr->writer_closed, __ATOMIC_SEQ_CST);
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST);
+        uint64_t tail = hdr->tail;
+
+        if (closed || head - tail > have) {
+            __atomic_store_n(&hdr->reader_waiting, 0, __ATOMIC_RELAXED);
+            *p = ring->data + tail % ring->capacity;
+            *eof = closed;
+            return head - tail;
+        }
+        shm_ring_futex_wait(&hdr->data_seq, seq, NULL);
+        __atomic_store_n(&hdr->reader_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*Consumer: releases n bytes of the last span*/
+static inline void shm_ring_consume(struct shm_ring* ring, size_t n) {
+    struct shm_ring_header* hdr = ring->hdr;
+    __atomic_store_n(&hdr->tail, hdr->tail + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->writer_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&hdr->space_seq, 1, __ATOMIC_SEQ_CST);
+        shm_ring_futex_wake(&hdr->space_seq, 1);
+    }
+}
+
+/*Consumer: stops reading, a waiting writer gives up*/
+static inline void shm_ring_close_reader(struct shm_ring* ring) {
+    __atomic_store_n(&ring->hdr->reader_closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&ring->hdr->space_seq, 1, __ATOMIC_SEQ_CST);
+    shm_ring_futex_wake(&ring->hdr->space_seq, 1);
+}
+
+#endif
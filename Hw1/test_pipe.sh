@@ -0,0 +1,6 @@
+# Producer stage of a "|>" test: calc -b runs write into the ring themselves, the rest goes through the relay
+calc -b ../Hw0/test1.in
+echo 2+2
+calc -b ../Hw0/test1.in > /dev/null
+calc -b ../Hw0/test1.in
+echo 3*3
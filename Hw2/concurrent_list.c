@@ -174,7 +174,11 @@ void remove_value(list* list, int value)
     // Removing the head if that's the requested node
     if (list->head->value == value) {
         node* toDelete = list->head;
-        list->head = list->head->next;
+
+        // Waiting for a thread that passed the entrance earlier and still holds the head
+        pthread_mutex_lock(&(toDelete->lock));
+        list->head = toDelete->next;
+        pthread_mutex_unlock(&(toDelete->lock));
 
         pthread_mutex_destroy(&(toDelete->lock));
         free(toDelete);
@@ -13,6 +13,7 @@
 #include <linux/string.h>
 
 #include "encdec.h"
+#include "encdec_transform.h"
 
 #define MODULE_NAME "encdec"
 
@@ -195,11 +196,8 @@ ssize_t encdec_read_caesar(struct file *filp, char *buf, size_t count, loff_t *f
     memcpy(read_buf, caesar_buff + *f_pos, bytes_to_read);
 
     // Decrypt data if necessary
-    if (data->read_state == ENCDEC_READ_STATE_DECRYPT) {
-        size_t i;
-        for (i = 0; i < bytes_to_read; i++)
-            read_buf[i] = (read_buf[i] - data->key + 128) % 128;
-    }
+    if (data->read_state == ENCDEC_READ_STATE_DECRYPT)
+        encdec_caesar_decrypt(read_buf, bytes_to_read, data->key);
 
     // Copy data to user space
     if (copy_to_user(buf, read_buf, bytes_to_read)) {
@@ -242,9 +240,7 @@ ssize_t encdec_write_caesar(struct file *filp, const char *buf, size_t count, lo
     }
 
     // Encrypt data
-    size_t i;
-    for (i = 0; i < bytes_to_write; i++)
-        write_buf[i] = (write_buf[i] + data->key) % 128;
+    encdec_caesar_encrypt(write_buf, bytes_to_write, data->key);
 
     // Copy data to the buffer
     memcpy(caesar_buff + *f_pos, write_buf, bytes_to_write);
@@ -281,11 +277,8 @@ ssize_t encdec_read_xor(struct file *filp, char *buf, size_t count, loff_t *f_po
     memcpy(read_buf, xor_buff + *f_pos, bytes_to_read);
 
     // Decrypt data if necessary
-    if (data->read_state == ENCDEC_READ_STATE_DECRYPT) {
-        size_t i;
-        for (i = 0; i < bytes_to_read; i++)
-            read_buf[i] ^= data->key;
-    }
+    if (data->read_state == ENCDEC_READ_STATE_DECRYPT)
+        encdec_xor(read_buf, bytes_to_read, data->key);
 
     // Copy data to user space
     if (copy_to_user(buf, read_buf, bytes_to_read)) {
@@ -328,9 +321,7 @@ ssize_t encdec_write_xor(struct file *filp, const char *buf, size_t count, loff_
     }
 
     // Encrypt data
-    size_t i;
-    for (i = 0; i < bytes_to_write; i++)
-        write_buf[i] ^= data->key;
+    encdec_xor(write_buf, bytes_to_write, data->key);
 
     // Copy data to the buffer
    memcpy(xor_buff + *f_pos, write_buf, bytes_to_write);
@@ -0,0 +1,36 @@
+#ifndef ENCDEC_TRANSFORM_H
+#define ENCDEC_TRANSFORM_H
+
+// The cipher transforms of the encdec device. They only touch the given buffer, so the
+// same code is used by the module and by the userspace benchmark.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#endif
+
+// Caesar cipher over 7-bit characters
+static inline void encdec_caesar_encrypt(char *buf, size_t count, unsigned char key)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        buf[i] = (buf[i] + key) % 128;
+}
+
+static inline void encdec_caesar_decrypt(char *buf, size_t count, unsigned char key)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        buf[i] = (buf[i] - key + 128) % 128;
+}
+
+// XOR cipher, encryption and decryption are the same operation
+static inline void encdec_xor(char *buf, size_t count, unsigned char key)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        buf[i] ^= key;
+}
+
+#endif
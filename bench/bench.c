@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../Hw2/concurrent_list.h"
+#include "../Hw3/encdec_transform.h"
+
+/*Benchmark runner for the four components. Results are printed as JSON, one metric per line. Metrics ending in
+"_per_sec" are better when higher, metrics ending in "_us" are better when lower. The exit status is 1 if a
+benchmarked program failed. With --baseline, metrics worse than the stored value by more than the tolerance and
+baseline metrics that were not measured are reported as regressions and the exit status is 2.*/
+
+#define CALC_LINES 2000000
+#define SHELL_COMMANDS 300
+#define LIST_OPS 20000           // operations per thread
+#define LIST_KEYS 256            // values are drawn from 0..LIST_KEYS-1, keeping the list short
+#define ENCDEC_BYTES (16 << 20)
+#define ENCDEC_ROUNDS 8
+#define MAX_METRICS 64
+
+struct metric {
+    char name[64];
+    double value;
+};
+
+static struct metric metrics[MAX_METRICS];
+static int metric_count;
+static int failed_runs;
+
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_metric(const char* name, double value) {
+    if (metric_count == MAX_METRICS) return;
+    snprintf(metrics[metric_count].name, sizeof(metrics[metric_count].name), "%s", name);
+    metrics[metric_count].value = value;
+    metric_count++;
+}
+
+/*Writes 'text' to a new temporary file and returns its path, which the caller unlinks and frees*/
+static char* temp_file(const char* text, size_t len) {
+    char* path = strdup("/tmp/bench-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+    close(fd);
+    return path;
+}
+
+/*Runs argv with stdin read from 'input' and stdout discarded. Returns the wall time, or -1 if it failed, which
+is counted in failed_runs.*/
+static double run_timed(char* const argv[], const char* input) {
+    double start = seconds_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int in = open(input, O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0) _exit(127);
+        dup2(in, 0);
+        dup2(out, 1);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        failed_runs++;
+        return -1;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", argv[0]);
+        failed_runs++;
+        return -1;
+    }
+    return seconds_now() - start;
+}
+
+static void bench_calc(char* calc) {
+    static const char ops[] = "+-*/";
+    char* text = malloc(CALC_LINES * 6);
+    unsigned int seed = 1;
+
+    // Lines of the form "d o d", divisors never zero
+    for (int i = 0; i < CALC_LINES; i++) {
+        char* line = text + i * 6;
+        line[0] = '0' + rand_r(&seed) % 10;
+        line[1] = ' ';
+        line[2] = ops[rand_r(&seed) % 4];
+        line[3] = ' ';
+        line[4] = '1' + rand_r(&seed) % 9;
+        line[5] = '\n';
+    }
+    char* path = temp_file(text, CALC_LINES * 6);
+    free(text);
+
+    char* interactive[] = { calc, NULL };
+    char* batch[] = { calc, "-b", path, NULL };
+    double t = run_timed(interactive, path);
+    if (t >= 0) add_metric("calc_lines_per_sec", CALC_LINES / t);
+    t = run_timed(batch, path);
+    if (t >= 0) add_metric("calc_batch_lines_per_sec", CALC_LINES / t);
+
+    unlink(path);
+    free(path);
+}
+
+static void bench_shell(char* shell) {
+    size_t len = SHELL_COMMANDS * 5 + 5;
+    char* text = malloc(len + 1);
+    for (int i = 0; i < SHELL_COMMANDS; i++) {
+        memcpy(text + i * 5, "true\n", 5);
+    }
+    memcpy(text + SHELL_COMMANDS * 5, "exit\n", 5);
+    char* path = temp_file(text, len);
+    free(text);
+
+    // Keep the benchmark out of the user's history file
+    setenv("MYSHELL_HISTFILE", "", 1);
+    char* argv[] = { shell, NULL };
+    double t = run_timed(argv, path);
+    if (t >= 0) add_metric("myshell_spawn_latency_us", t / SHELL_COMMANDS * 1e6);
+
+    unlink(path);
+    free(path);
+}
+
+struct list_worker {
+    list* list;
+    unsigned int seed;
+};
+
+static void* list_worker_run(void* arg) {
+    struct list_worker* w = arg;
+    for (int i = 0; i < LIST_OPS; i++) {
+        int value = rand_r(&w->seed) % LIST_KEYS;
+        if (rand_r(&w->seed) & 1) {
+            insert_value(w->list, value);
+        }
+        else {
+            remove_value(w->list, value);
+        }
+    }
+    return NULL;
+}
+
+static void bench_list(int max_threads) {
+    pthread_t threads[max_threads];
+    struct list_worker workers[max_threads];
+
+    // 1, 2, 4, ... threads, always ending with max_threads
+    for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        list* l = create_list();
+        for (int v = 0; v < LIST_KEYS; v += 2) {
+            insert_value(l, v);
+        }
+
+        double start = seconds_now();
+        for (int i = 0; i < n; i++) {
+            workers[i].list = l;
+            workers[i].seed = i + 1;
+            pthread_create(&threads[i], NULL, list_worker_run, &workers[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double t = seconds_now() - start;
+        delete_list(l);
+
+        char name[64];
+        snprintf(name, sizeof(name), "list_ops_per_sec_t%d", n);
+        add_metric(name, (double)n * LIST_OPS / t);
+        if (n == max_threads) break;
+    }
+}
+
+static void bench_encdec(void) {
+    char* buf = malloc(ENCDEC_BYTES);
+    for (int i = 0; i < ENCDEC_BYTES; i++) {
+        buf[i] = 'a' + i % 26;
+    }
+
+    // Each round encrypts and decrypts the buffer, so it counts twice
+    double start = seconds_now();
+    for (int r = 0; r < ENCDEC_ROUNDS; r++) {
+        encdec_caesar_encrypt(buf, ENCDEC_BYTES, 3);
+        encdec_caesar_decrypt(buf, ENCDEC_BYTES, 3);
+    }
+    add_metric("encdec_caesar_bytes_per_sec", 2.0 * ENCDEC_ROUNDS * ENCDEC_BYTES / (seconds_now() - start));
+
+    start = seconds_now();
+    for (int r = 0; r < ENCDEC_ROUNDS; r++) {
+        encdec_xor(buf, ENCDEC_BYTES, 0x5a);
+        encdec_xor(buf, ENCDEC_BYTES, 0x5a);
+    }
+    add_metric("encdec_xor_bytes_per_sec", 2.0 * ENCDEC_ROUNDS * ENCDEC_BYTES / (seconds_now() - start));
+
+    // Keep the transforms from being optimized away
+    if (buf[0] != 'a') {
+        fprintf(stderr, "encdec round trip failed\n");
+    }
+    free(buf);
+}
+
+/*Compares the results with a baseline in the same format. Returns the number of regressions, a baseline metric
+missing from the results counts as one. Returns -1 if the baseline cannot be read.*/
+static int check_baseline(const char* path, double tolerance, FILE* report) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256], name[64];
+    double base;
+    int regressions = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, " \"%63[^\"]\" : %lf", name, &base) != 2) continue;
+        int found = 0;
+        for (int i = 0; i < metric_count; i++) {
+            if (strcmp(metrics[i].name, name) != 0) continue;
+            found = 1;
+            size_t len = strlen(name);
+            int lower_is_better = len > 3 && strcmp(name + len - 3, "_us") == 0;
+            double value = metrics[i].value;
+            if (lower_is_better ? value > base * (1 + tolerance) : value < base * (1 - tolerance)) {
+                fprintf(report, "REGRESSION %s: %.1f, baseline %.1f\n", name, value, base);
+                regressions++;
+            }
+        }
+        if (!found) {
+            fprintf(report, "REGRESSION %s: not measured, baseline %.1f\n", name, base);
+            regressions++;
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+int main(int argc, char* argv[]) {
+    char* calc = "build/calc";
+    char* shell = "build/myshell";
+    const char* baseline = NULL;
+    double tolerance = 0.2;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--calc") == 0) calc = argv[i + 1];
+        else if (strcmp(argv[i], "--shell") == 0) shell = argv[i + 1];
+        else if (strcmp(argv[i], "--baseline") == 0) baseline = argv[i + 1];
+        else if (strcmp(argv[i], "--tolerance") == 0) tolerance = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+        else {
+            fprintf(stderr, "usage: %s [--calc path] [--shell path] [--threads n] [--baseline file] [--tolerance fraction]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+
+    bench_calc(calc);
+    bench_shell(shell);
+    bench_list(threads);
+    bench_encdec();
+
+    printf("{\n");
+    for (int i = 0; i < metric_count; i++) {
+        printf("  \"%s\": %.1f%s\n", metrics[i].name, metrics[i].value, i + 1 < metric_count ? "," : "");
+    }
+    printf("}\n");
+
+    int regressions = baseline != NULL ? check_baseline(baseline, tolerance, stderr) : 0;
+    if (failed_runs > 0 || regressions < 0) {
+        return 1;
+    }
+    return regressions > 0 ? 2 : 0;
+}